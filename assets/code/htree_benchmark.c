@@ -4,14 +4,29 @@
 #include <time.h>
 #include <sys/time.h>
 #include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BLOCK_SIZE 4096
 #define MAX_FILENAME 255
 #define NUM_FILES 10000
 #define FILENAME_LENGTH 20
+#define NUM_LOOKUPS 1000
+#define DIST_BUCKETS 64
+#define COLLISION_BITS 6
 #define MAX_ENTRIES_PER_BLOCK ((BLOCK_SIZE - sizeof(struct block_header)) / sizeof(struct dir_entry))
 #define MAX_INDEX_ENTRIES ((BLOCK_SIZE - sizeof(struct block_header)) / sizeof(struct index_entry))
 
+// Hash versions, as in ext4's s_def_hash_version
+#define DX_HASH_DJB2     0  // the old unseeded hash, kept for comparison
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA      2
+
+// Set in an index entry's hash when its block continues a run of entries
+// with the same hash from the previous block. Real hashes always have it clear.
+#define DX_HASH_CONTINUED 1
+
 // Forward declarations
 struct htree_directory;
 struct htree_block;
@@ -45,12 +60,24 @@ struct htree_block {
     } data;
 };
 
+// The root block indexes index blocks, which index entry blocks. Index
+// entries are sorted by hash; entry 0 of a block has no lower bound and
+// covers everything below entry 1.
 struct htree_directory {
     struct htree_block* root_block;
     struct htree_block** index_blocks;
     struct htree_block** entry_blocks;
     uint32_t num_index_blocks;
     uint32_t num_entry_blocks;
+    uint32_t hash_version;
+    uint32_t hash_seed[4];
+    uint32_t num_continuations;
+};
+
+// Position of an entry block: a slot in the root and a slot in that index block
+struct dx_frame {
+    uint32_t root_slot;
+    uint32_t slot;
 };
 
 // Benchmark results structure
@@ -58,104 +85,439 @@ struct benchmark_results {
     double insertion_time;
     double search_time;
     double memory_usage;
+    int lookups_failed;
 };
 
-// Hash function for filenames
-uint32_t hash_filename(const char* name) {
-    uint32_t hash = 0;
-    while (*name) {
-        hash = (hash << 5) + hash + *name;
-        name++;
+// Packs a name into 32-bit words the way ext4's str2hashbuf_unsigned does,
+// padding with the length so names that are prefixes of each other differ
+void str2hashbuf(const char* msg, int len, uint32_t* buf, int num) {
+    const unsigned char* ucp = (const unsigned char*) msg;
+    uint32_t pad = (uint32_t) len | ((uint32_t) len << 8);
+    pad |= pad << 16;
+
+    uint32_t val = pad;
+    if (len > num * 4) {
+        len = num * 4;
+    }
+    for (int i = 0; i < len; i++) {
+        val = ucp[i] + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0) {
+        *buf++ = val;
+    }
+    while (--num >= 0) {
+        *buf++ = pad;
     }
-    return hash;
 }
 
-// Initialize H-tree directory
-struct htree_directory* init_htree_directory() {
-    struct htree_directory* dir = malloc(sizeof(struct htree_directory));
-    if (!dir) return NULL;
+static inline uint32_t rol32(uint32_t word, unsigned int shift) {
+    return (word << shift) | (word >> (32 - shift));
+}
 
-    // Initialize root block
-    dir->root_block = malloc(sizeof(struct htree_block));
-    if (!dir->root_block) {
-        free(dir);
-        return NULL;
+// The first three rounds of MD4, over 32 bytes of name at a time
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+#define ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    // Round 1
+    ROUND(F, a, b, c, d, in[0] + K1, 3);
+    ROUND(F, d, a, b, c, in[1] + K1, 7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1, 3);
+    ROUND(F, d, a, b, c, in[5] + K1, 7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    // Round 2
+    ROUND(G, a, b, c, d, in[1] + K2, 3);
+    ROUND(G, d, a, b, c, in[3] + K2, 5);
+    ROUND(G, c, d, a, b, in[5] + K2, 9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2, 3);
+    ROUND(G, d, a, b, c, in[2] + K2, 5);
+    ROUND(G, c, d, a, b, in[4] + K2, 9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    // Round 3
+    ROUND(H, a, b, c, d, in[3] + K3, 3);
+    ROUND(H, d, a, b, c, in[7] + K3, 9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3, 3);
+    ROUND(H, d, a, b, c, in[5] + K3, 9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+// 16 rounds of TEA, over 16 bytes of name at a time
+#define TEA_DELTA 0x9E3779B9
+
+void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+    for (int n = 0; n < 16; n++) {
+        sum += TEA_DELTA;
+        b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+        b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
     }
+    buf[0] += b0;
+    buf[1] += b1;
+}
 
-    dir->root_block->header.block_type = 1;
-    dir->root_block->header.entry_count = 0;
-    dir->root_block->header.free_space = BLOCK_SIZE - sizeof(struct block_header);
+// Hash function for filenames. Half-MD4 and TEA start from the directory's
+// seed, so names that collide in one directory don't collide in another.
+uint32_t hash_filename(const struct htree_directory* dir, const char* name, int len) {
+    uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint32_t in[8];
+    uint32_t hash;
 
-    dir->index_blocks = NULL;
-    dir->entry_blocks = NULL;
-    dir->num_index_blocks = 0;
-    dir->num_entry_blocks = 0;
+    if (dir->hash_seed[0] | dir->hash_seed[1] | dir->hash_seed[2] | dir->hash_seed[3]) {
+        memcpy(buf, dir->hash_seed, sizeof(buf));
+    }
 
-    return dir;
+    switch (dir->hash_version) {
+    case DX_HASH_HALF_MD4:
+        for (const char* p = name; len > 0; len -= 32, p += 32) {
+            str2hashbuf(p, len, in, 8);
+            half_md4_transform(buf, in);
+        }
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA:
+        for (const char* p = name; len > 0; len -= 16, p += 16) {
+            str2hashbuf(p, len, in, 4);
+            tea_transform(buf, in);
+        }
+        hash = buf[0];
+        break;
+    default:
+        hash = 0;
+        for (int i = 0; i < len; i++) {
+            hash = (hash << 5) + hash + name[i];
+        }
+        break;
+    }
+
+    return hash & ~DX_HASH_CONTINUED;
 }
 
-// Add a new entry block
-struct htree_block* add_entry_block(struct htree_directory* dir) {
-    dir->num_entry_blocks++;
-    dir->entry_blocks = realloc(dir->entry_blocks,
-                               dir->num_entry_blocks * sizeof(struct htree_block*));
-    if (!dir->entry_blocks) return NULL;
+// Compares a name against an entry with the same name_len, 16 bytes at a
+// time. The entry's name field is always MAX_FILENAME bytes long, so short
+// names can be read as a whole vector on that side.
+int names_equal(const char* entry_name, const char* name, int len) {
+#if defined(__SSE2__)
+    if (len >= 16) {
+        int off;
+        for (off = 0; off + 16 <= len; off += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*) (entry_name + off));
+            __m128i b = _mm_loadu_si128((const __m128i*) (name + off));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xffff) {
+                return 0;
+            }
+        }
+        if (off < len) {
+            // The last 16 bytes, overlapping the previous block
+            __m128i a = _mm_loadu_si128((const __m128i*) (entry_name + len - 16));
+            __m128i b = _mm_loadu_si128((const __m128i*) (name + len - 16));
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xffff;
+        }
+        return 1;
+    }
 
-    struct htree_block* block = malloc(sizeof(struct htree_block));
-    if (!block) {
-        dir->num_entry_blocks--;
-        return NULL;
+    char tail[16] = {0};
+    memcpy(tail, name, len);
+    int mask = (1 << len) - 1;
+    __m128i a = _mm_loadu_si128((const __m128i*) entry_name);
+    __m128i b = _mm_loadu_si128((const __m128i*) tail);
+    return (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & mask) == mask;
+#else
+    return memcmp(entry_name, name, len) == 0;
+#endif
+}
+
+// Random per-directory seed, like the one mkfs stores in the superblock
+void generate_hash_seed(uint32_t seed[4]) {
+    FILE* f = fopen("/dev/urandom", "rb");
+    if (!f || fread(seed, sizeof(uint32_t), 4, f) != 4) {
+        for (int i = 0; i < 4; i++) {
+            seed[i] = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+        }
+    }
+    if (f) {
+        fclose(f);
     }
+}
+
+struct htree_block* alloc_block(uint32_t block_type) {
+    struct htree_block* block = malloc(sizeof(struct htree_block));
+    if (!block) return NULL;
 
-    block->header.block_type = 3;
+    block->header.block_type = block_type;
     block->header.entry_count = 0;
     block->header.free_space = BLOCK_SIZE - sizeof(struct block_header);
+    return block;
+}
+
+// Add a new index block
+struct htree_block* add_index_block(struct htree_directory* dir) {
+    struct htree_block** blocks = realloc(dir->index_blocks,
+                                          (dir->num_index_blocks + 1) * sizeof(struct htree_block*));
+    if (!blocks) return NULL;
+    dir->index_blocks = blocks;
+
+    struct htree_block* block = alloc_block(2);
+    if (!block) return NULL;
+
+    dir->index_blocks[dir->num_index_blocks++] = block;
+    return block;
+}
+
+// Add a new entry block
+struct htree_block* add_entry_block(struct htree_directory* dir) {
+    struct htree_block** blocks = realloc(dir->entry_blocks,
+                                          (dir->num_entry_blocks + 1) * sizeof(struct htree_block*));
+    if (!blocks) return NULL;
+    dir->entry_blocks = blocks;
+
+    struct htree_block* block = alloc_block(3);
+    if (!block) return NULL;
 
-    dir->entry_blocks[dir->num_entry_blocks - 1] = block;
+    dir->entry_blocks[dir->num_entry_blocks++] = block;
     return block;
 }
 
+void add_index_entry(struct htree_block* block, uint32_t slot, uint32_t hash, uint32_t block_number) {
+    struct index_entry* at = &block->data.indices[slot];
+    memmove(at + 1, at, (block->header.entry_count - slot) * sizeof(struct index_entry));
+    at->hash = hash;
+    at->block_number = block_number;
+    block->header.entry_count++;
+    block->header.free_space -= sizeof(struct index_entry);
+}
+
+// Initialize H-tree directory: an empty root, index block and entry block
+struct htree_directory* init_htree_directory(uint32_t hash_version) {
+    struct htree_directory* dir = calloc(1, sizeof(struct htree_directory));
+    if (!dir) return NULL;
+
+    dir->hash_version = hash_version;
+    if (hash_version != DX_HASH_DJB2) {
+        generate_hash_seed(dir->hash_seed);
+    }
+
+    dir->root_block = alloc_block(1);
+    if (!dir->root_block || !add_index_block(dir) || !add_entry_block(dir)) {
+        free(dir->root_block);
+        free(dir);
+        return NULL;
+    }
+
+    add_index_entry(dir->root_block, 0, 0, 0);
+    add_index_entry(dir->index_blocks[0], 0, 0, 0);
+    return dir;
+}
+
+// Last slot in an index block whose hash is <= hash. Continued entries have
+// the low bit set, so this stops at the first block of a run.
+uint32_t dx_search(const struct htree_block* block, uint32_t hash) {
+    uint32_t lo = 1, hi = block->header.entry_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (block->data.indices[mid].hash > hash) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo - 1;
+}
+
+struct htree_block* frame_index_block(struct htree_directory* dir, const struct dx_frame* frame) {
+    return dir->index_blocks[dir->root_block->data.indices[frame->root_slot].block_number];
+}
+
+struct htree_block* frame_entry_block(struct htree_directory* dir, const struct dx_frame* frame) {
+    return dir->entry_blocks[frame_index_block(dir, frame)->data.indices[frame->slot].block_number];
+}
+
 // Find appropriate entry block for a hash value
-struct htree_block* find_entry_block(struct htree_directory* dir, uint32_t hash) {
-    for (uint32_t i = 0; i < dir->num_entry_blocks; i++) {
-        struct htree_block* block = dir->entry_blocks[i];
-        if (block->header.entry_count < MAX_ENTRIES_PER_BLOCK) {
-            return block;
+struct htree_block* find_entry_block(struct htree_directory* dir, uint32_t hash, struct dx_frame* frame) {
+    frame->root_slot = dx_search(dir->root_block, hash);
+    frame->slot = dx_search(frame_index_block(dir, frame), hash);
+    return frame_entry_block(dir, frame);
+}
+
+// Moves to the next entry block if it continues the run of +hash+
+struct htree_block* next_entry_block(struct htree_directory* dir, uint32_t hash, struct dx_frame* frame) {
+    struct dx_frame next = *frame;
+
+    if (++next.slot == frame_index_block(dir, &next)->header.entry_count) {
+        if (++next.root_slot == dir->root_block->header.entry_count) {
+            return NULL;
         }
+        next.slot = 0;
     }
-    return add_entry_block(dir);
+
+    if (frame_index_block(dir, &next)->data.indices[next.slot].hash != (hash | DX_HASH_CONTINUED)) {
+        return NULL;
+    }
+    *frame = next;
+    return frame_entry_block(dir, frame);
+}
+
+// Adds an index entry after the frame's slot, splitting the index block if
+// it is full. The frame is moved along if its slot ends up in the new block.
+int insert_index_entry(struct htree_directory* dir, struct dx_frame* frame, uint32_t hash, uint32_t block_number) {
+    struct htree_block* block = frame_index_block(dir, frame);
+
+    if (block->header.entry_count == MAX_INDEX_ENTRIES) {
+        if (dir->root_block->header.entry_count == MAX_INDEX_ENTRIES) {
+            return -1;  // directory is full
+        }
+        struct htree_block* upper = add_index_block(dir);
+        if (!upper) return -1;
+
+        uint32_t split = block->header.entry_count / 2;
+        uint32_t moved = block->header.entry_count - split;
+        memcpy(upper->data.indices, &block->data.indices[split], moved * sizeof(struct index_entry));
+        upper->header.entry_count = moved;
+        upper->header.free_space -= moved * sizeof(struct index_entry);
+        block->header.entry_count = split;
+        block->header.free_space += moved * sizeof(struct index_entry);
+
+        add_index_entry(dir->root_block, frame->root_slot + 1, upper->data.indices[0].hash,
+                        dir->num_index_blocks - 1);
+        if (frame->slot >= split) {
+            frame->root_slot++;
+            frame->slot -= split;
+            block = upper;
+        }
+    }
+
+    add_index_entry(block, frame->slot + 1, hash, block_number);
+    return 0;
+}
+
+struct hashed_entry {
+    uint32_t hash;
+    uint32_t index;
+};
+
+int compare_hashed_entries(const void* a, const void* b) {
+    uint32_t ha = ((const struct hashed_entry*) a)->hash;
+    uint32_t hb = ((const struct hashed_entry*) b)->hash;
+    return ha < hb ? -1 : ha > hb;
+}
+
+// Splits a full entry block at its median hash, moving the upper half to a
+// new block. If the median hash also appears below the split, the new block
+// is marked as continuing it. Leaves the frame on the half +hash+ goes to.
+int split_entry_block(struct htree_directory* dir, struct dx_frame* frame, uint32_t hash) {
+    struct htree_block* block = frame_entry_block(dir, frame);
+    uint32_t count = block->header.entry_count;
+    struct hashed_entry map[MAX_ENTRIES_PER_BLOCK];
+    struct dir_entry entries[MAX_ENTRIES_PER_BLOCK];
+
+    for (uint32_t i = 0; i < count; i++) {
+        map[i].hash = hash_filename(dir, block->data.entries[i].name, block->data.entries[i].name_len);
+        map[i].index = i;
+    }
+    qsort(map, count, sizeof(map[0]), compare_hashed_entries);
+
+    uint32_t split = count / 2;
+    uint32_t split_hash = map[split].hash;
+    int continued = map[split - 1].hash == split_hash;
+
+    struct htree_block* upper = add_entry_block(dir);
+    if (!upper) return -1;
+    if (insert_index_entry(dir, frame, split_hash | (continued ? DX_HASH_CONTINUED : 0),
+                           dir->num_entry_blocks - 1) != 0) {
+        return -1;
+    }
+    if (continued) {
+        dir->num_continuations++;
+    }
+
+    memcpy(entries, block->data.entries, count * sizeof(struct dir_entry));
+    for (uint32_t i = 0; i < count; i++) {
+        struct htree_block* to = i < split ? block : upper;
+        to->data.entries[i < split ? i : i - split] = entries[map[i].index];
+    }
+    block->header.entry_count = split;
+    block->header.free_space = BLOCK_SIZE - sizeof(struct block_header) - split * sizeof(struct dir_entry);
+    upper->header.entry_count = count - split;
+    upper->header.free_space -= (count - split) * sizeof(struct dir_entry);
+
+    if (hash >= split_hash) {
+        frame->slot++;
+    }
+    return 0;
 }
 
 // Insert a file into the H-tree directory
-void insert_file(struct htree_directory* dir, const char* name, uint32_t inode) {
-    uint32_t hash = hash_filename(name);
-    struct htree_block* block = find_entry_block(dir, hash);
-    if (!block) return;
+int insert_file(struct htree_directory* dir, const char* name, uint32_t inode) {
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_FILENAME) return -1;
+
+    struct dx_frame frame;
+    uint32_t hash = hash_filename(dir, name, (int) len);
+    struct htree_block* block = find_entry_block(dir, hash, &frame);
+
+    if (block->header.entry_count == MAX_ENTRIES_PER_BLOCK) {
+        if (split_entry_block(dir, &frame, hash) != 0) return -1;
+        block = frame_entry_block(dir, &frame);
+    }
 
     struct dir_entry* entry = &block->data.entries[block->header.entry_count];
     entry->inode = inode;
-    entry->name_len = strlen(name);
+    entry->name_len = (uint8_t) len;
     entry->rec_len = sizeof(struct dir_entry);
     entry->file_type = 1; // Regular file
     strncpy(entry->name, name, MAX_FILENAME);
 
     block->header.entry_count++;
     block->header.free_space -= sizeof(struct dir_entry);
+    return 0;
 }
 
 // Search for a file in the H-tree directory
 struct dir_entry* find_file(struct htree_directory* dir, const char* name) {
-    uint32_t hash = hash_filename(name);
+    size_t len = strlen(name);
+    if (len == 0 || len > MAX_FILENAME) return NULL;
 
-    for (uint32_t i = 0; i < dir->num_entry_blocks; i++) {
-        struct htree_block* block = dir->entry_blocks[i];
+    struct dx_frame frame;
+    uint32_t hash = hash_filename(dir, name, (int) len);
+    struct htree_block* block = find_entry_block(dir, hash, &frame);
+
+    do {
         for (uint32_t j = 0; j < block->header.entry_count; j++) {
             struct dir_entry* entry = &block->data.entries[j];
-            if (strcmp(entry->name, name) == 0) {
+            if (entry->name_len == len && names_equal(entry->name, name, (int) len)) {
                 return entry;
             }
         }
-    }
+    } while ((block = next_entry_block(dir, hash, &frame)) != NULL);
+
     return NULL;
 }
 
@@ -201,37 +563,65 @@ void cleanup_htree_directory(struct htree_directory* dir) {
     free(dir);
 }
 
+const char* hash_version_name(uint32_t hash_version) {
+    switch (hash_version) {
+    case DX_HASH_HALF_MD4: return "half-MD4";
+    case DX_HASH_TEA: return "TEA";
+    default: return "djb2";
+    }
+}
+
+// Report how evenly the hash spread the entries: over entry blocks, and
+// over DIST_BUCKETS equal ranges of hash values
+void report_distribution(struct htree_directory* dir) {
+    uint32_t fill[MAX_ENTRIES_PER_BLOCK + 1] = {0};
+    uint32_t buckets[DIST_BUCKETS] = {0};
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < dir->num_entry_blocks; i++) {
+        struct htree_block* block = dir->entry_blocks[i];
+        fill[block->header.entry_count]++;
+        total += block->header.entry_count;
+        for (uint32_t j = 0; j < block->header.entry_count; j++) {
+            struct dir_entry* entry = &block->data.entries[j];
+            uint32_t hash = hash_filename(dir, entry->name, entry->name_len);
+            buckets[(uint64_t) hash * DIST_BUCKETS >> 32]++;
+        }
+    }
+
+    printf("Entry blocks: %u, index blocks: %u, continued runs: %u\n",
+           dir->num_entry_blocks, dir->num_index_blocks, dir->num_continuations);
+    printf("Average fill: %.1f%%\n",
+           100.0 * total / (dir->num_entry_blocks * (double) MAX_ENTRIES_PER_BLOCK));
+    printf("Entries per block:");
+    for (uint32_t n = 0; n <= MAX_ENTRIES_PER_BLOCK; n++) {
+        if (fill[n]) printf(" %u:%u", n, fill[n]);
+    }
+    printf("\n");
+
+    // Chi-square against a uniform spread; about DIST_BUCKETS - 1 is good
+    double expected = (double) total / DIST_BUCKETS;
+    double chi_square = 0;
+    uint32_t min = UINT32_MAX, max = 0;
+    for (int b = 0; b < DIST_BUCKETS; b++) {
+        double diff = buckets[b] - expected;
+        chi_square += diff * diff / expected;
+        if (buckets[b] < min) min = buckets[b];
+        if (buckets[b] > max) max = buckets[b];
+    }
+    printf("Hash buckets (%d): min %u, max %u, expected %.1f, chi-square %.1f\n",
+           DIST_BUCKETS, min, max, expected, chi_square);
+}
+
 // Run benchmark tests
-struct benchmark_results run_htree_benchmark() {
+struct benchmark_results run_htree_benchmark(uint32_t hash_version, char** filenames) {
     struct benchmark_results results = {0};
-    struct htree_directory* dir = init_htree_directory();
+    struct htree_directory* dir = init_htree_directory(hash_version);
     if (!dir) {
         printf("Failed to initialize H-tree directory\n");
         return results;
     }
 
-    char** filenames = malloc(NUM_FILES * sizeof(char*));
-    if (!filenames) {
-        cleanup_htree_directory(dir);
-        printf("Failed to allocate memory for filenames\n");
-        return results;
-    }
-
-    // Generate filenames
-    for (int i = 0; i < NUM_FILES; i++) {
-        filenames[i] = malloc(FILENAME_LENGTH + 1);
-        if (!filenames[i]) {
-            for (int j = 0; j < i; j++) {
-                free(filenames[j]);
-            }
-            free(filenames);
-            cleanup_htree_directory(dir);
-            printf("Failed to allocate memory for filename %d\n", i);
-            return results;
-        }
-        generate_filename(filenames[i]);
-    }
-
     // Measure insertion time
     double start_time = get_time();
     for (int i = 0; i < NUM_FILES; i++) {
@@ -241,9 +631,11 @@ struct benchmark_results run_htree_benchmark() {
 
     // Measure search time (random access)
     start_time = get_time();
-    for (int i = 0; i < 1000; i++) {
+    for (int i = 0; i < NUM_LOOKUPS; i++) {
         int index = rand() % NUM_FILES;
-        find_file(dir, filenames[index]);
+        if (!find_file(dir, filenames[index])) {
+            results.lookups_failed++;
+        }
     }
     results.search_time = get_time() - start_time;
 
@@ -251,16 +643,55 @@ struct benchmark_results run_htree_benchmark() {
     results.memory_usage = sizeof(struct htree_directory) +
                           sizeof(struct htree_block) * (1 + dir->num_index_blocks + dir->num_entry_blocks);
 
-    // Cleanup
-    for (int i = 0; i < NUM_FILES; i++) {
-        free(filenames[i]);
-    }
-    free(filenames);
+    report_distribution(dir);
     cleanup_htree_directory(dir);
 
     return results;
 }
 
+// Names made of "aa" and "b@" pairs all have the same djb2 hash, since
+// 'a' * 33 + 'a' == 'b' * 33 + '@'. Checks that lookups follow the run
+// of equal hashes across entry blocks.
+int run_collision_test() {
+    const int count = 1 << COLLISION_BITS;
+    char name[2 * COLLISION_BITS + 1];
+    uint32_t first_hash = 0;
+    int found = 0;
+
+    struct htree_directory* dir = init_htree_directory(DX_HASH_DJB2);
+    if (!dir) return -1;
+
+    for (int pass = 0; pass < 3; pass++) {
+        for (int i = 0; i < count; i++) {
+            for (int bit = 0; bit < COLLISION_BITS; bit++) {
+                memcpy(name + 2 * bit, (i >> bit) & 1 ? "b@" : "aa", 2);
+            }
+            name[2 * COLLISION_BITS] = '\0';
+
+            if (pass == 0) {
+                // The test means nothing unless the names really collide
+                uint32_t hash = hash_filename(dir, name, 2 * COLLISION_BITS);
+                if (i == 0) first_hash = hash;
+                if (hash != first_hash) {
+                    printf("Collision test: %s hashes to %08x, not %08x\n", name, hash, first_hash);
+                    cleanup_htree_directory(dir);
+                    return -1;
+                }
+            } else if (pass == 1) {
+                insert_file(dir, name, i + 1);
+            } else {
+                struct dir_entry* entry = find_file(dir, name);
+                found += entry && entry->inode == (uint32_t) i + 1;
+            }
+        }
+    }
+
+    printf("Collision test: %d names with one djb2 hash, %u entry blocks, %u continued, %d found\n",
+           count, dir->num_entry_blocks, dir->num_continuations, found);
+    cleanup_htree_directory(dir);
+    return found == count ? 0 : -1;
+}
+
 int main() {
     srand(time(NULL));
 
@@ -269,16 +700,51 @@ int main() {
     printf("- Number of files: %d\n", NUM_FILES);
     printf("- Block size: %d bytes\n", BLOCK_SIZE);
     printf("- Max entries per block: %lu\n", MAX_ENTRIES_PER_BLOCK);
+#if defined(__SSE2__)
+    printf("- Name comparison: SSE2\n");
+#else
+    printf("- Name comparison: memcmp\n");
+#endif
 
-    struct benchmark_results results = run_htree_benchmark();
+    char** filenames = malloc(NUM_FILES * sizeof(char*));
+    if (!filenames) {
+        printf("Failed to allocate memory for filenames\n");
+        return 1;
+    }
+
+    // Generate filenames
+    for (int i = 0; i < NUM_FILES; i++) {
+        filenames[i] = malloc(FILENAME_LENGTH + 1);
+        if (!filenames[i]) {
+            printf("Failed to allocate memory for filename %d\n", i);
+            return 1;
+        }
+        generate_filename(filenames[i]);
+    }
+
+    const uint32_t hash_versions[] = { DX_HASH_DJB2, DX_HASH_HALF_MD4, DX_HASH_TEA };
+    for (size_t v = 0; v < sizeof(hash_versions) / sizeof(hash_versions[0]); v++) {
+        printf("\n%s hash:\n", hash_version_name(hash_versions[v]));
+        struct benchmark_results results = run_htree_benchmark(hash_versions[v], filenames);
+
+        printf("Insertion time for %d files: %.3f seconds\n", NUM_FILES, results.insertion_time);
+        printf("Average search time (%d random lookups): %.6f seconds\n",
+               NUM_LOOKUPS, results.search_time / NUM_LOOKUPS);
+        printf("Memory usage: %.2f MB\n", results.memory_usage / (1024.0 * 1024.0));
+        printf("Average insertion time per file: %.6f ms\n",
+               (results.insertion_time * 1000.0) / NUM_FILES);
+        if (results.lookups_failed) {
+            printf("Lookups that failed: %d\n", results.lookups_failed);
+        }
+    }
 
-    printf("\nBenchmark Results:\n");
-    printf("Insertion time for %d files: %.3f seconds\n", NUM_FILES, results.insertion_time);
-    printf("Average search time (1000 random lookups): %.6f seconds\n",
-           results.search_time / 1000.0);
-    printf("Memory usage: %.2f MB\n", results.memory_usage / (1024.0 * 1024.0));
-    printf("Average insertion time per file: %.6f ms\n",
-           (results.insertion_time * 1000.0) / NUM_FILES);
+    printf("\n");
+    int status = run_collision_test();
 
-    return 0;
+    for (int i = 0; i < NUM_FILES; i++) {
+        free(filenames[i]);
+    }
+    free(filenames);
+
+    return status == 0 ? 0 : 1;
 }